@@ -13,16 +13,33 @@
 #include <vector>
 #include <map>
 #include <algorithm>  // for_each
+#include <climits>  // SHRT_MAX
+#include <deque>
+// prefetching files in separate threads, C++11 required
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 //#include <initializer_list>  // C++11, usage of -std=gnu++11 or -std=c++11 required
 // accessing files and directories
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>  // free disk space
 
+#include <RVersion.h>
 #include <TROOT.h>
+#if ROOT_VERSION_CODE < ROOT_VERSION(6,6,0)
+#include <TThread.h>
+#endif
 #include <TFile.h>
 #include <TTree.h>
+#include <TBranch.h>
+#include <TBasket.h>
+#include <TBuffer.h>
 #include <TH1.h>
 #include <TH2.h>
+#include <TAxis.h>
 #include <TLorentzVector.h>
 #include <TCanvas.h>
 #include <TStyle.h>
@@ -30,6 +47,7 @@
 #include <TLegend.h>
 #include <THStack.h>
 #include <TList.h>
+#include <TMath.h>
 
 typedef std::map<int, const char*> IntCharMap;
 typedef std::pair<int, const char*> ICPair;
@@ -42,23 +60,161 @@ typedef std::pair<int, std::vector<const char*>> IVcPair;
 typedef std::map<int, std::vector<int>>::iterator IViIter;
 typedef std::map<int, std::vector<int>>::const_iterator constIViIter;  // const_iterator needed while iterating through const map
 typedef std::map<int, std::vector<const char*>>::iterator IVcIter;
+
+// precision used to store the collected 4-vectors; memory per particle and event: TLorentzVector ~64 bytes, float 12 bytes, fixed-point 6 bytes
+enum P4Storage {
+	P4_DOUBLE,  // TLorentzVector, full precision
+	P4_FLOAT,  // px, py, pz as float
+	P4_FIXED16  // px, py, pz as 16 bit integers, quantized relative to the kinematic limit of the particle
+};
+
+/* Stores the 4-vectors of one final state particle for all events. Depending on the storage mode they are kept as TLorentzVector or compressed to float or 16 bit fixed-point values. For the reduced precisions only the momentum is stored and E is rebuilt from the mass of the particle, a separately rounded E would spoil E - M, especially for photons. The operator[] always returns a TLorentzVector, so the analysis methods don't have to care about the used precision. */
+class P4Column {
+public:
+	P4Column(P4Storage mode = P4_DOUBLE, double range = 1600.) : mode(mode), scale(range/SHRT_MAX), mass(0), n(0) {}
+	void set_range(double range) { scale = range/SHRT_MAX; }  // maximum absolute momentum component in MeV for the fixed-point storage, only to be changed while empty
+	void reserve(size_t size);
+	bool push_back(const TLorentzVector& v);  // returns false if a component exceeded the fixed-point range and got clipped
+	TLorentzVector operator[](size_t j) const;
+	size_t size() const { return n; }
+	size_t bytes() const { return n*bytes_per_entry(mode); }  // memory used for the stored 4-vectors
+	static size_t bytes_per_entry(P4Storage mode);
+	void clear(bool release = false);  // removes all 4-vectors, the allocated memory is only freed if release is true
+	void write(FILE* file) const;  // writes the stored 4-vectors in their storage precision
+	bool read(FILE* file, size_t size);  // replaces the content by size 4-vectors written with write()
+private:
+	Short_t quantize(double x, bool& clipped) const;
+	P4Storage mode;
+	double scale;  // MeV per fixed-point unit
+	double mass;  // taken from the first stored 4-vector in full precision
+	size_t n;
+	std::vector<TLorentzVector> d;
+	std::vector<Float_t> f;  // px, py, pz of every event stored one after another
+	std::vector<Short_t> s;  // same layout as f
+};
+
+// bin migration of the reduced precision storage compared to double precision
+struct PrecisionCheck {
+	PrecisionCheck() : maxE(0), maxTheta(0), migrated(0), clipped(0), total(0) {}
+	void compare(const TLorentzVector& orig, const TLorentzVector& stored, const TAxis& axE, const TAxis& axTheta);
+	int maxE, maxTheta;  // maximum number of bins an entry moved
+	Long64_t migrated, clipped, total;
+};
+
+// events read from one file, all particles of all events are stored contiguously, the particles of event i are in [offset[i], offset[i+1])
+struct EventBatch {
+	EventBatch(size_t capacity) : channel(-1), nEvents(0), fileEvents(0), offset(capacity+1) {}
+	int channel;
+	int nEvents;
+	Long64_t fileEvents;  // number of events which will be read from the file, only set for the first batch of a file to reserve memory
+	std::vector<Int_t> offset;
+	std::vector<Double_t> p4[4];  // px, py, pz, E in GeV as stored in the tree
+};
+
+/* Thread safe queue of event batches with a fixed capacity. push() blocks as long as the queue is full, pop() blocks until a batch is available or returns 0 if the queue is closed and empty. */
+class BatchQueue {
+public:
+	BatchQueue(size_t depth) : depth(depth), closed(false) {}
+	void push(EventBatch* b);
+	EventBatch* pop();
+	void close();
+private:
+	size_t depth;
+	bool closed;
+	std::deque<EventBatch*> q;
+	std::mutex m;
+	std::condition_variable notFull, notEmpty;
+};
+typedef std::pair<int, const char*> FileJob;  // channel and file name which should be read
+typedef std::map<int, std::atomic<bool>> IntFlagMap;  // e. g. channels which should not be read any further
+
+// criterion used to decide if the histograms of a channel are stable and reading can be stopped
+enum Convergence {
+	CONV_NONE,  // read all events up to READ_LIMIT
+	CONV_RELERR,  // relative statistical error of every bin containing at least 1 % of the maximum bin content
+	CONV_KS  // maximum Kolmogorov-Smirnov distance between the distributions of the even and the odd events
+};
+
+/* Energy and theta distributions of the final state particles of one channel, filled while reading. check() is called in fixed intervals and tells if all distributions reached the requested precision. */
+class ConvergenceMonitor {
+public:
+	ConvergenceMonitor(int channel, const std::vector<int>& partIdx);
+	~ConvergenceMonitor();
+	void fill(size_t particle, const TLorentzVector& v, int half);
+	bool check(Convergence criterion, double precision);
+private:
+	std::vector<TH1D*> h;
+	std::vector<TH1D*> half[2];  // two disjoint samples of alternate events for the Kolmogorov-Smirnov distance
+};
+
+// how the 4-vectors of a channel are handled, chosen depending on the memory budget
+enum ChannelMode {
+	MODE_CACHE,  // all 4-vectors are kept in memory
+	MODE_SPILL,  // 4-vectors are written to disk in chunks and read back chunk by chunk for every plot
+	MODE_STREAM  // histograms are filled chunk by chunk while reading, the 4-vectors are discarded afterwards
+};
+const char* const MODE_NAME[] = {"cache", "spill", "stream"};
+
+// analysis methods which are run for every channel
+enum Analysis {
+	ANA_ENERGIES,
+	ANA_THETAS,
+	ANA_THETA_VS_ENERGY,
+	ANA_PHOTON_PAIRS,
+	N_ANALYSES
+};
+
+struct ChannelPlan {
+	ChannelPlan() : mode(MODE_CACHE), order(0), events(0), bytes(0), spill(0) { for (int a = 0; a < N_ANALYSES; a++) results[a] = 0; }
+	ChannelMode mode;
+	int order;  // position in which the channel is read
+	Long64_t events;  // expected number of events
+	size_t bytes;  // expected memory to cache all 4-vectors
+	char spillFile[100];
+	FILE* spill;
+	TList* results[N_ANALYSES];  // histograms filled while streaming
+};
+typedef std::map<int, ChannelPlan> IntPlanMap;
+
 // one map containing all 4-vectors (reading all information from MC Tree file only once required)
-typedef std::map<int, std::vector<std::vector<TLorentzVector>>> IntP4Map;
-typedef std::pair<int, std::vector<std::vector<TLorentzVector>>> IP4Pair;
-typedef std::map<int, std::vector<std::vector<TLorentzVector>>>::iterator IP4Iter;
-typedef std::vector<std::vector<TLorentzVector>> VVP4;
+typedef std::map<int, std::vector<P4Column>> IntP4Map;
+typedef std::pair<int, std::vector<P4Column>> IP4Pair;
+typedef std::map<int, std::vector<P4Column>>::iterator IP4Iter;
+typedef std::vector<P4Column> VVP4;
 typedef VVP4::const_iterator VVP4Iter;
 
-//static const double MASS_PROTON = 938.272;
+static const double MASS_PROTON = 938.272;
+static const double BEAM_ENERGY = 1600.;  // maximum photon beam energy in MeV, defines the kinematic limits for the fixed-point storage
 static int count = 0;  // counter used for individual histogram naming
-static const int READ_LIMIT = 1000000;  // limit to which number events are read per file; number smaller than zero for all events, e. g. -1
-
-int collect_particles(IntP4Map& p4, const IntVecintMap& idx, const char files[][100], const int nFiles = 1);  // structure of two-dimensional char array has to be char a[][n] or, equivalent, char (a*)[n]
+static const int READ_LIMIT = 1000000;  // limit to which number events are read per file; number smaller than zero for all events, e. g. -1; with reduced precision storage it can be raised accordingly
+static const P4Storage STORAGE = P4_DOUBLE;  // storage precision of the 4-vectors, for a reduced one the bin migration compared to double precision is reported
+static const int PREFETCH_THREADS = 2;  // number of threads opening and decompressing the files ahead while the events are processed
+static const int QUEUE_DEPTH = 8;  // maximum number of event batches in flight between the reading threads and the processing
+static const int BATCH_SIZE = 10000;  // number of events per batch
+static const Long64_t CACHE_SIZE = 30000000;  // size of the TTreeCache in bytes used while reading a file
+static const Convergence CONVERGENCE = CONV_NONE;  // adaptive reading: stop reading a channel once its histograms reached CONV_PRECISION, READ_LIMIT is ignored in this case
+static const double CONV_PRECISION = .02;  // maximum relative bin error or KS distance, depending on the criterion
+static const int CONV_INTERVAL = 100000;  // number of events of a channel after which the convergence is checked
+static const double MERGE_ANGLE = 12.;  // opening angle in degree below which two photons are assumed to form only one cluster in the calorimeter
+static const int PAIR_BLOCK = 256;  // number of events processed together in the photon pair calculation
+static const int CHUNK_EVENTS = 100000;  // number of events per chunk of a spilled or streamed channel
+
+void plan_channels(IntPlanMap& plan, const IntVecintMap& idx, const IntCharMap& channel, const char files[][100], const int nFiles, const double budget, const char* dir);
+int collect_particles(IntP4Map& p4, const IntVecintMap& idx, const IntVecharMap& names, IntPlanMap& plan, const char files[][100], const int nFiles = 1);  // structure of two-dimensional char array has to be char a[][n] or, equivalent, char (a*)[n]
+void prefetch_files(const std::vector<FileJob>& jobs, std::atomic<size_t>& next, std::atomic<int>& active, const IntFlagMap& done, BatchQueue& freeQ, BatchQueue& fullQ);
+void decode_batch(TBranch* const br[4], Long64_t first, Long64_t last, EventBatch* b);
+void decode_leaf(TBranch* br, Long64_t first, Long64_t last, const std::vector<Int_t>& offset, Double_t* dest);
+TBasket* load_basket(TBranch* br, Long64_t entry, Long64_t& basketFirst, Long64_t& basketEnd);
 void prepare_hist(TH1 *h, const char* x_name, const char* y_name = "#Events", Int_t color = 3);
 void prepare_hist(THStack *h, const char* x_name, const char* y_name = "#Events");
 TList* energies(const VVP4& p4, const std::vector<int> partIdx);
 TList* thetas(const VVP4& p4, const std::vector<int> partIdx);
 TList* theta_vs_energy(const VVP4& p4, const std::vector<int> partIdx);
+TList* photon_pairs(const VVP4& p4, const std::vector<int> partIdx, const std::vector<const char*> partNames);
+void flush_chunk(VVP4& cols, const std::vector<int>& partIdx, const std::vector<const char*>& partNames, ChannelPlan& plan, bool last);
+TList* run_analysis(Analysis a, const VVP4& p4, const std::vector<int>& partIdx, const std::vector<const char*>& partNames);
+void merge_lists(TList*& sum, TList* part);
+TList* analyse(Analysis a, int chan, const IntP4Map& p4, const IntVecintMap& idx, const IntVecharMap& names, IntPlanMap& plan);
 TH1F* etapEnergy_etap_eeg(const char* file);
 
 int main(int argc, char **argv)
@@ -68,7 +224,17 @@ int main(int argc, char **argv)
 	int iMax;  // index of histogram with maximum
 	TH1 *h_tmp;  // for temporary histogram usage
 	int j, p;  // counter used for several plots etc.
-	TIter *iter;  // Iterator for TList, used to iterate through THStack and TList
+	TIter *iter = 0;  // Iterator for TList, used to iterate through THStack and TList
+	double memBudget = -1;  // memory budget in MB, negative for no limit
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--mem-budget") && i+1 < argc && atof(argv[i+1]) > 0)
+			memBudget = atof(argv[++i]);
+		else {
+			fprintf(stderr, "Usage: %s [--mem-budget <MB>]\n", argv[0]);
+			exit(1);
+		}
+	}
 
 	// vectors used for dynamically changes for histogram stacking and file naming
 	std::vector<int> indices;
@@ -161,10 +327,19 @@ int main(int argc, char **argv)
 	std::cout << "The following data path will be used: " << path << std::endl
 	<< "Number of files per channel: " << nFiles << std::endl
 	<< "Maximum number of events read per file: ";
-	if (READ_LIMIT < 0)
+	if (CONVERGENCE != CONV_NONE)
+		std::cout << "until the histograms are stable within " << CONV_PRECISION << (CONVERGENCE == CONV_KS ? " (KS distance)" : " (relative bin error)") << std::endl;
+	else if (READ_LIMIT < 0)
 		std::cout << "all events" << std::endl;
 	else
 		std::cout << READ_LIMIT << std::endl;
+	std::cout << "4-vectors are stored with ";
+	if (STORAGE == P4_FLOAT)
+		std::cout << "float precision" << std::endl;
+	else if (STORAGE == P4_FIXED16)
+		std::cout << "16 bit fixed-point precision" << std::endl;
+	else
+		std::cout << "double precision" << std::endl;
 	for (ICIter it = channel.begin(); it != channel.end(); ++it)
 		for (UInt_t i = 1; i <= nFiles; i++)
 			sprintf(sim_files[nFiles*it->first+i-1], "%s/sim_%s_%02d.root", path, it->second, i);
@@ -225,11 +400,15 @@ int main(int argc, char **argv)
 	c2->SetBottomMargin(.12);
 	c2->SetTopMargin(.1);
 
+	// decide for every channel whether its 4-vectors are cached, spilled to disk or streamed
+	IntPlanMap plan;
+	plan_channels(plan, indicesFS, channel, sim_files, nFiles, memBudget, save);
+
 	// gather all needed particle information (4-vectors) from the generated files
 	IntP4Map p4FS;
 	for (IViIter it = indicesFS.begin(); it != indicesFS.end(); ++it)
-		p4FS.insert(IP4Pair(it->first, std::vector<std::vector<TLorentzVector>>(it->second.size())));
-	if (!collect_particles(p4FS, indicesFS, sim_files, nFiles))
+		p4FS.insert(IP4Pair(it->first, VVP4(it->second.size(), P4Column(STORAGE))));
+	if (!collect_particles(p4FS, indicesFS, namesFS, plan, sim_files, nFiles))
 		printf("\n[INFO] All particles collected!\n\n");
 	else
 		printf("\nSome error occurred...\n\n");
@@ -266,7 +445,7 @@ int main(int argc, char **argv)
 		hs = new THStack(buffer, "");
 		if (!iter)
 			delete iter;
-		iter = new TIter(energies(p4FS.find(it->first)->second, it->second));
+		iter = new TIter(analyse(ANA_ENERGIES, it->first, p4FS, indicesFS, namesFS, plan));
 		j = 0;
 		while (h_tmp = (TH1*)iter->Next()) {
 			if (strstr(h_tmp->GetTitle(), "p")) {  // proton
@@ -427,7 +606,7 @@ int main(int argc, char **argv)
 		hs = new THStack(buffer, "");
 		if (!iter)
 			delete iter;
-		iter = new TIter(thetas(p4FS.find(it->first)->second, it->second));
+		iter = new TIter(analyse(ANA_THETAS, it->first, p4FS, indicesFS, namesFS, plan));
 		j = 0;
 		while (h_tmp = (TH1*)iter->Next()) {
 			if (strstr(h_tmp->GetTitle(), "p")) {  // proton
@@ -487,7 +666,7 @@ int main(int argc, char **argv)
 		if (!iter)
 			delete iter;
 		//iter = new TIter(theta_vs_energy(sim_files[it->first], it->second));
-		iter = new TIter(theta_vs_energy(p4FS.find(it->first)->second, it->second));
+		iter = new TIter(analyse(ANA_THETA_VS_ENERGY, it->first, p4FS, indicesFS, namesFS, plan));
 		j = 0;
 		while (h_tmp = (TH2F*)iter->Next()) {
 			c2->Clear();
@@ -503,67 +682,642 @@ int main(int argc, char **argv)
 		}
 	}
 
+	// opening angles and invariant masses of all photon pairs, used to estimate how often photons merge into one cluster
+	std::cout << "[INFO] Create plots for photon pairs" << std::endl;
+	const char* pairPlots[4] = {"photon_opening_angles", "photon_min_opening_angle", "photon_pair_masses", "photon_clusters"};
+	c->cd();
+	for (IViIter it = indicesFS.begin(); it != indicesFS.end(); ++it) {
+		TList *l = analyse(ANA_PHOTON_PAIRS, it->first, p4FS, indicesFS, namesFS, plan);
+		if (!l->GetSize()) {  // less than two photons in the final state
+			delete l;
+			continue;
+		}
+		delete iter;
+		iter = new TIter(l);
+		j = 0;
+		while (h_tmp = (TH1*)iter->Next()) {
+			c->Clear();
+			if (strstr(h_tmp->GetTitle(), "clusters")) {
+				// the last bin contains the events where all photons are separated
+				p = h_tmp->GetNbinsX();
+				printf("  %s: %.2f%% of the events with merged photons (opening angle < %.1f deg)\n", channel.find(it->first)->second,
+					h_tmp->GetEntries() ? 100.*(1.-h_tmp->GetBinContent(p)/h_tmp->GetEntries()) : 0., MERGE_ANGLE);
+			}
+			h_tmp->SetLineColor(color[1]);
+			h_tmp->SetTitle("");
+			h_tmp->Draw();
+			c->Update();
+			sprintf(buffer, "%s/%s_%s.%s", save, pairPlots[j++], identifier.find(it->first)->second, ext);
+			c->Print(buffer);
+		}
+		delete l;
+	}
+
+	for (std::map<int, ChannelPlan>::iterator it = plan.begin(); it != plan.end(); ++it)
+		if (it->second.mode == MODE_SPILL)
+			remove(it->second.spillFile);
+
 	return 0;
 }
 
 
-int collect_particles(IntP4Map& p4, const IntVecintMap& idx, const char files[][100], const int nFiles)
+void plan_channels(IntPlanMap& plan, const IntVecintMap& idx, const IntCharMap& channel, const char files[][100], const int nFiles, const double budget, const char* dir)
 {
-	printf("[INFO] Start collecting final state particles for %d channels . . .\n\n", p4.size());
-
-	TTree* MCTree;
-	Long64_t treeSize;
-	Int_t part;
-	Int_t pid[20];
-	Double_t fE[20];
-	Double_t fPx[20];
-	Double_t fPy[20];
-	Double_t fPz[20];
+	const Long64_t limit = CONVERGENCE == CONV_NONE ? READ_LIMIT : -1;
+	const double MB = 1048576.;
+	Long64_t entries;
+	size_t peak;
+	std::vector<std::pair<size_t, int>> bySize;  // expected memory and channel
+	std::vector<size_t> chunk;  // memory of one chunk for every channel in bySize
+
+	// without a budget all channels are cached and read in their usual order, no file has to be opened for an estimate
+	if (budget < 0) {
+		int i = 0;
+		for (constIViIter it = idx.begin(); it != idx.end(); ++it)
+			plan[it->first].order = i++;
+		printf("[INFO] No memory budget given, all channels are cached\n\n");
+		return;
+	}
 
-	for (int n = 0; n < nFiles; n++) {
-		for (constIViIter it = idx.begin(); it != idx.end(); ++it) {
+	// estimate the memory per channel from the number of events in the files and the final state size
+	for (constIViIter it = idx.begin(); it != idx.end(); ++it) {
+		ChannelPlan& cp = plan[it->first];
+		for (int n = 0; n < nFiles; n++) {
 			TFile f(files[nFiles*it->first+n], "READ");
 			if (!f.IsOpen()) {
-				fprintf(stderr, "Error opening file %s: %s\n", files[it->first], strerror(errno));
+				fprintf(stderr, "Error opening file %s: %s\n", files[nFiles*it->first+n], strerror(errno));
 				exit(1);
 			}
-
-			MCTree = (TTree*)f.Get("data");
+			TTree* MCTree = (TTree*)f.Get("data");
 			if (!MCTree) {
 				perror("Error opening TTree 'data'");
 				exit(1);
 			}
-			treeSize = MCTree->GetEntries();
-			printf("%d events in file %s\n", treeSize, files[it->first]);
-			/* i will be an iterator over an two-dimensional vector of objects of the type TLorentzVector, as p4.find(it->first)->second delivers this vector inside the p4 map regarding the actually processed channel. The outer vector should have the size of the number of final state particles as described in the second part of the indices map, like the vector is initialized earlier in the main method. So the for loop with the iterator i should have e. g. 6 steps for a decay with 6 particles in the final state. The size of the inner vector, which can be accessed via the iterator i, a pointer to this vector, should be zero in the first run because it isn't initialized in the main method. What we want now is to reserve the expected size of this vector that all the events from the tree file can be stored in it without reallocating memory after every few push_backs. Speeds up the system execution time. Therefore we use the initial size (0 for the first run or the amount of stored events in later loop runs) plus the new size. */
-			for (std::vector<std::vector<TLorentzVector>>::iterator i = p4.find(it->first)->second.begin(); i != p4.find(it->first)->second.end(); ++i)
-				i->reserve(i->size()+treeSize);
-				//std::cout << i->size() << std::endl;  // should be zero for all entries as the vector inside the vector isn't initialized yet
-
-			MCTree->SetMakeClass(1);
-			MCTree->SetBranchAddress("Particles", &part);
-			MCTree->SetBranchAddress("Particles.pid", pid);
-			MCTree->SetBranchAddress("Particles.fE", fE);
-			MCTree->SetBranchAddress("Particles.fP.fX", fPx);
-			MCTree->SetBranchAddress("Particles.fP.fY", fPy);
-			MCTree->SetBranchAddress("Particles.fP.fZ", fPz);
-
-			for (int i = 0; i < treeSize; i++) {
-				if (i == READ_LIMIT) break;  // limiting events read per file to READ_LIMIT due to heavy ram usage...
-				MCTree->GetEntry(i);
-				for (int j = 0; j < it->second.size(); j++)
-					p4.find(it->first)->second[j].push_back(TLorentzVector(1000*fPx[it->second[j]], 1000*fPy[it->second[j]], 1000*fPz[it->second[j]], 1000*fE[it->second[j]]));
-			}
-
+			entries = MCTree->GetEntries();
+			cp.events += limit < 0 ? entries : std::min(entries, limit);
 			f.Close();
 		}
+		cp.bytes = cp.events*it->second.size()*P4Column::bytes_per_entry(STORAGE);
+		sprintf(cp.spillFile, "%s/.spill_%d.bin", dir, it->first);
+		bySize.push_back(std::make_pair(cp.bytes, it->first));
+	}
+	std::sort(bySize.begin(), bySize.end());
+
+	// memory needed in any case: the event batches in flight with up to 20 particles per event
+	const size_t batchBytes = QUEUE_DEPTH*BATCH_SIZE*(20*4*sizeof(Double_t)+sizeof(Int_t));
+	struct statvfs fs;
+	double disk = statvfs(dir, &fs) ? 0. : (double)fs.f_bavail*fs.f_frsize;
+
+	/* Spilled and streamed channels only need memory for one chunk, which is released once the last event of the channel is processed. They're read first, but as several files are read at the same time the cached channels may already fill the memory while chunks are still in use. So the peak is estimated as all cached channels plus one chunk of every other channel. Starting with no channel cached, the smallest channels are cached as long as this peak fits into the budget. The ones which don't fit are spilled to disk while there's enough free space, otherwise they're streamed. */
+	peak = batchBytes;
+	for (std::vector<std::pair<size_t, int>>::iterator it = bySize.begin(); it != bySize.end(); ++it) {
+		chunk.push_back(std::min(plan[it->second].events, (Long64_t)CHUNK_EVENTS)*idx.find(it->second)->second.size()*P4Column::bytes_per_entry(STORAGE));
+		peak += chunk.back();
+	}
+	std::vector<int> transient, resident;
+	for (int i = 0; i < bySize.size(); i++) {
+		ChannelPlan& cp = plan[bySize[i].second];
+		if (peak-chunk[i]+cp.bytes <= budget*MB) {
+			cp.mode = MODE_CACHE;
+			peak += cp.bytes-chunk[i];
+			resident.push_back(bySize[i].second);
+			continue;
+		}
+		if (cp.bytes <= disk) {
+			cp.mode = MODE_SPILL;
+			disk -= cp.bytes;
+		} else
+			cp.mode = MODE_STREAM;
+		transient.push_back(bySize[i].second);
+	}
+	transient.insert(transient.end(), resident.begin(), resident.end());
+	for (int i = 0; i < transient.size(); i++)
+		plan[transient[i]].order = i;
+
+	printf("[INFO] Memory budget: %.0f MB\n", budget);
+	printf("Channels will be read in the following order:\n");
+	for (int i = 0; i < transient.size(); i++) {
+		const ChannelPlan& cp = plan[transient[i]];
+		printf("  %-16s %10lld events, %8.1f MB expected, %s\n", channel.find(transient[i])->second, cp.events, cp.bytes/MB, MODE_NAME[cp.mode]);
+	}
+	printf("Expected peak memory: %.1f MB\n\n", peak/MB);
+	if (peak > budget*MB)
+		printf("Warning: memory budget too small for the event batches and one chunk per channel, it will be exceeded!\n\n");
+}
+
+int collect_particles(IntP4Map& p4, const IntVecintMap& idx, const IntVecharMap& names, IntPlanMap& plan, const char files[][100], const int nFiles)
+{
+	printf("[INFO] Start collecting final state particles for %d channels . . .\n\n", p4.size());
+
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,6,0)
+	ROOT::EnableThreadSafety();
+#else
+	TThread::Initialize();
+#endif
+
+	TLorentzVector v;
+	Int_t k;
+
+	/* binning of the energy and theta histograms, used to check how many entries migrate to a different bin due to reduced storage precision */
+	const TAxis axE(1000, 0, 1000), axTheta(360, 0, 180);
+	std::map<int, PrecisionCheck> check;
+
+	// with adaptive reading the histograms of every channel are checked after CONV_INTERVAL events, the readers skip the remaining events of a channel once it converged
+	std::map<int, ConvergenceMonitor*> monitor;
+	std::map<int, Long64_t> events;
+	IntFlagMap done;
+	for (constIViIter it = idx.begin(); it != idx.end(); ++it) {
+		done[it->first] = false;
+		events[it->first] = 0;
+		if (CONVERGENCE != CONV_NONE)
+			monitor[it->first] = new ConvergenceMonitor(it->first, it->second);
+	}
+
+	/* The files are read by PREFETCH_THREADS threads which open the next files ahead and fill the events into batches, while this thread stores the 4-vectors of the filled batches. The batches are reused: a reading thread takes an empty one from the free queue and passes it to the full queue when it's filled, after processing it's given back to the free queue. As only QUEUE_DEPTH batches exist, the reading threads wait if the processing can't keep up. */
+	// the files are read channel by channel in the order chosen by the memory plan
+	std::vector<std::pair<int, int>> order;
+	for (IntPlanMap::iterator it = plan.begin(); it != plan.end(); ++it) {
+		order.push_back(std::make_pair(it->second.order, it->first));
+		if (it->second.mode == MODE_SPILL && !(it->second.spill = fopen(it->second.spillFile, "wb"))) {
+			fprintf(stderr, "Error opening spill file %s: %s\n", it->second.spillFile, strerror(errno));
+			exit(1);
+		}
+	}
+	std::sort(order.begin(), order.end());
+	std::vector<FileJob> jobs;
+	for (std::vector<std::pair<int, int>>::iterator it = order.begin(); it != order.end(); ++it)
+		for (int n = 0; n < nFiles; n++)
+			jobs.push_back(FileJob(it->second, files[nFiles*it->second+n]));
+
+	std::vector<EventBatch*> batches;
+	BatchQueue freeQ(QUEUE_DEPTH), fullQ(QUEUE_DEPTH);
+	for (int i = 0; i < QUEUE_DEPTH; i++) {
+		batches.push_back(new EventBatch(BATCH_SIZE));
+		freeQ.push(batches.back());
+	}
+
+	std::atomic<size_t> next(0);
+	std::atomic<int> active(PREFETCH_THREADS);
+	std::vector<std::thread> readers;
+	for (int i = 0; i < PREFETCH_THREADS; i++)
+		readers.push_back(std::thread(prefetch_files, std::cref(jobs), std::ref(next), std::ref(active), std::cref(done), std::ref(freeQ), std::ref(fullQ)));
+
+	EventBatch* b;
+	while ((b = fullQ.pop())) {
+		if (done.find(b->channel)->second) {  // batch was already in the queue when the channel converged
+			freeQ.push(b);
+			continue;
+		}
+		const std::vector<int>& fs = idx.find(b->channel)->second;
+		VVP4& cols = p4.find(b->channel)->second;
+		ChannelPlan& cp = plan.find(b->channel)->second;
+		if (STORAGE == P4_FIXED16 && !events[b->channel] && b->nEvents) {
+			/* The fixed-point range of each final state particle is its kinematic limit: a beam photon of at most BEAM_ENERGY on a proton at rest leaves a particle at most the total energy minus the masses of the other final state particles. The masses are the same for all events, they're taken from the first one. Clipping can only happen if BEAM_ENERGY is set too low and is counted in the precision check. */
+			std::vector<double> m(fs.size());
+			double sum = 0, eMax;
+			for (int j = 0; j < fs.size(); j++) {
+				k = b->offset[0]+fs[j];
+				m[j] = 1000*sqrt(std::max(0., b->p4[3][k]*b->p4[3][k] - b->p4[0][k]*b->p4[0][k] - b->p4[1][k]*b->p4[1][k] - b->p4[2][k]*b->p4[2][k]));
+				sum += m[j];
+			}
+			printf("Channel %d: fixed-point ranges", b->channel);
+			for (int j = 0; j < fs.size(); j++) {
+				eMax = BEAM_ENERGY + MASS_PROTON - (sum - m[j]);
+				cols[j].set_range(sqrt(eMax*eMax - m[j]*m[j]));
+				printf(" %.1f", sqrt(eMax*eMax - m[j]*m[j]));
+			}
+			printf(" MeV\n");
+		}
+		if (b->fileEvents)  // first batch of a file, reserve memory for all of its events (or one chunk if not cached) to prevent reallocating after every few push_backs
+			for (VVP4::iterator i = cols.begin(); i != cols.end(); ++i)
+				i->reserve(cp.mode == MODE_CACHE ? i->size()+b->fileEvents : CHUNK_EVENTS);
+		for (int i = 0; i < b->nEvents; i++) {
+			for (int j = 0; j < fs.size(); j++) {
+				k = b->offset[i]+fs[j];
+				v.SetXYZT(1000*b->p4[0][k], 1000*b->p4[1][k], 1000*b->p4[2][k], 1000*b->p4[3][k]);
+				if (!cols[j].push_back(v))
+					check[b->channel].clipped++;
+				if (STORAGE != P4_DOUBLE)
+					check[b->channel].compare(v, cols[j][cols[j].size()-1], axE, axTheta);
+				if (CONVERGENCE != CONV_NONE)
+					monitor[b->channel]->fill(j, v, events[b->channel] & 1);
+			}
+			if (++events[b->channel] % CONV_INTERVAL == 0 && CONVERGENCE != CONV_NONE
+					&& monitor[b->channel]->check(CONVERGENCE, CONV_PRECISION)) {
+				printf("Channel %d converged after %lld events\n", b->channel, events[b->channel]);
+				done.find(b->channel)->second = true;
+				break;
+			}
+			if (cp.mode != MODE_CACHE && cols[0].size() == CHUNK_EVENTS)
+				flush_chunk(cols, fs, names.find(b->channel)->second, cp, false);
+		}
+		// a spilled or streamed channel is finished once all of its events are read or it converged, its chunk memory is released right away instead of after all files
+		if (cp.mode != MODE_CACHE && (done.find(b->channel)->second || events[b->channel] == cp.events)) {
+			flush_chunk(cols, fs, names.find(b->channel)->second, cp, true);
+			if (cp.spill)
+				fclose(cp.spill);
+			cp.spill = 0;
+		}
+		freeQ.push(b);
+	}
+
+	for (std::vector<std::thread>::iterator it = readers.begin(); it != readers.end(); ++it)
+		it->join();
+	for (std::vector<EventBatch*>::iterator it = batches.begin(); it != batches.end(); ++it)
+		delete *it;
+	for (std::map<int, ConvergenceMonitor*>::iterator it = monitor.begin(); it != monitor.end(); ++it)
+		delete it->second;
+	// process the remaining events of spilled and streamed channels which contained less events than planned, the other ones are already finished
+	for (IntPlanMap::iterator it = plan.begin(); it != plan.end(); ++it) {
+		if (it->second.mode == MODE_CACHE)
+			continue;
+		flush_chunk(p4.find(it->first)->second, idx.find(it->first)->second, names.find(it->first)->second, it->second, true);
+		if (it->second.spill)
+			fclose(it->second.spill);
+		it->second.spill = 0;
 	}
 
 	std::cout << "Finished processing all files." << std::endl;
 
+	size_t bytes, total = 0;
+	for (IP4Iter it = p4.begin(); it != p4.end(); ++it) {
+		bytes = 0;
+		for (VVP4Iter i = it->second.begin(); i != it->second.end(); ++i)
+			bytes += i->bytes();
+		total += bytes;
+		printf("Channel %d: %lld events (%s), %.1f MB used for 4-vectors\n", it->first, events[it->first], MODE_NAME[plan.find(it->first)->second.mode], bytes/1048576.);
+		if (CONVERGENCE != CONV_NONE && !done[it->first])
+			printf("  not converged, all available events used\n");
+		if (STORAGE == P4_DOUBLE)
+			continue;
+		PrecisionCheck& pc = check[it->first];
+		printf("  maximum bin migration compared to double precision: %d bins in E, %d bins in theta; %lld of %lld entries migrated, %lld clipped\n",
+			pc.maxE, pc.maxTheta, pc.migrated, pc.total, pc.clipped);
+	}
+	printf("Total memory used for 4-vectors: %.1f MB\n", total/1048576.);
+
 	return 0;
 }
 
+
+void prefetch_files(const std::vector<FileJob>& jobs, std::atomic<size_t>& next, std::atomic<int>& active, const IntFlagMap& done, BatchQueue& freeQ, BatchQueue& fullQ)
+{
+	TTree* MCTree;
+	Long64_t treeSize, nRead, fileEvents, clusterEnd, decoded;
+	EventBatch* b;
+	size_t n;
+	double seconds;
+	const Long64_t limit = CONVERGENCE == CONV_NONE ? READ_LIMIT : -1;
+	const char* leaves[4] = {"Particles.fP.fX", "Particles.fP.fY", "Particles.fP.fZ", "Particles.fE"};
+	TBranch* br[4];
+
+	// every thread takes the next file which hasn't been read yet until all files are processed
+	while ((n = next++) < jobs.size()) {
+		const std::atomic<bool>& stop = done.find(jobs[n].first)->second;
+		if (stop)  // channel already converged, no need to open the file
+			continue;
+		TFile f(jobs[n].second, "READ");
+		if (!f.IsOpen()) {
+			fprintf(stderr, "Error opening file %s: %s\n", jobs[n].second, strerror(errno));
+			exit(1);
+		}
+
+		MCTree = (TTree*)f.Get("data");
+		if (!MCTree) {
+			perror("Error opening TTree 'data'");
+			exit(1);
+		}
+		treeSize = MCTree->GetEntries();
+		printf("%lld events in file %s\n", treeSize, jobs[n].second);
+
+		// only the baskets of the 4-vector leaves are read and decompressed, the tree never reads an entry itself
+		MCTree->SetMakeClass(1);
+		MCTree->SetBranchStatus("*", 0);
+		MCTree->SetBranchStatus("Particles", 1);
+		MCTree->SetCacheSize(CACHE_SIZE);
+		for (int l = 0; l < 4; l++) {
+			MCTree->SetBranchStatus(leaves[l], 1);
+			MCTree->AddBranchToCache(leaves[l]);
+			br[l] = MCTree->GetBranch(leaves[l]);
+		}
+
+		nRead = limit < 0 ? treeSize : std::min(treeSize, limit);
+		// when reading adaptively the number of needed events is unknown, don't reserve memory for the whole file then
+		fileEvents = CONVERGENCE != CONV_NONE ? 0 : nRead;
+		/* The events are decoded cluster by cluster (entry ranges which are stored in the same baskets for all branches), split into batches of at most BATCH_SIZE events. */
+		decoded = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		TTree::TClusterIterator clusters = MCTree->GetClusterIterator(0);
+		for (Long64_t cluster = clusters.Next(); cluster < nRead && !stop; cluster = clusters.Next()) {
+			clusterEnd = std::min(clusters.GetNextEntry(), nRead);
+			for (Long64_t first = cluster; first < clusterEnd && !stop; first += BATCH_SIZE) {
+				b = freeQ.pop();
+				b->channel = jobs[n].first;
+				b->fileEvents = fileEvents;
+				fileEvents = 0;
+				MCTree->LoadTree(first);  // lets the TTreeCache prefetch the baskets of this range
+				decode_batch(br, first, std::min(first+BATCH_SIZE, clusterEnd), b);
+				decoded += b->nEvents;
+				fullQ.push(b);
+			}
+		}
+		// includes the time waiting for free batches, so this is the rate of the whole pipeline if the processing is slower
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		printf("%lld events read from file %s in %.1f s (%.0f events/s)\n", decoded, jobs[n].second, seconds, seconds > 0 ? decoded/seconds : 0.);
+
+		f.Close();
+	}
+
+	// the last thread finishing tells the processing that no more batches will follow
+	if (--active == 0)
+		fullQ.close();
+}
+
+void decode_batch(TBranch* const br[4], Long64_t first, Long64_t last, EventBatch* b)
+{
+	/* No entry is read through the tree or the Particles branch, reading the parent branch would decode all of its enabled members for every entry. The number of particles of an event follows from the entry offsets of the energy basket instead: each entry holds one Double_t per particle, the last entry of a basket ends where the used part of its buffer ends. This gives the offset index of the events in the contiguous buffers. */
+	Long64_t entry = first, basketFirst, basketEnd;
+	Int_t nPart = 0, *entryOffset;
+	TBasket* basket;
+
+	b->nEvents = last-first;
+	while (entry < last) {
+		basket = load_basket(br[3], entry, basketFirst, basketEnd);
+		entryOffset = basket->GetEntryOffset();
+		for (; entry < std::min(basketEnd, last); entry++) {
+			b->offset[entry-first] = nPart;
+			nPart += ((entry+1 < basketEnd ? entryOffset[entry+1-basketFirst] : basket->GetLast()) - entryOffset[entry-basketFirst])/(Int_t)sizeof(Double_t);
+		}
+	}
+	b->offset[b->nEvents] = nPart;
+
+	for (int l = 0; l < 4; l++) {
+		b->p4[l].resize(nPart);  // keeps its capacity, so the buffers are only allocated for the first batches
+		decode_leaf(br[l], first, last, b->offset, b->p4[l].data());
+	}
+}
+
+void decode_leaf(TBranch* br, Long64_t first, Long64_t last, const std::vector<Int_t>& offset, Double_t* dest)
+{
+	// the values of a clones array member are stored one after another for every entry, so the values of an event are decoded with one ReadFastArray call directly into the contiguous buffer
+	Long64_t entry = first, basketFirst, basketEnd;
+	Int_t k, *entryOffset;
+	TBasket* basket;
+	TBuffer* buf;
+
+	while (entry < last) {
+		basket = load_basket(br, entry, basketFirst, basketEnd);
+		entryOffset = basket->GetEntryOffset();
+		buf = basket->GetBufferRef();
+		for (; entry < std::min(basketEnd, last); entry++) {
+			k = entry-first;
+			buf->SetBufferOffset(entryOffset[entry-basketFirst]);
+			buf->ReadFastArray(dest+offset[k], offset[k+1]-offset[k]);
+		}
+	}
+}
+
+TBasket* load_basket(TBranch* br, Long64_t entry, Long64_t& basketFirst, Long64_t& basketEnd)
+{
+	// returns the basket containing the entry together with its entry range, the reading relies on the entry offsets which are always written for clones array members
+	Long64_t* basketEntry = br->GetBasketEntry();
+	const Int_t nBaskets = br->GetWriteBasket();  // baskets written to the file, a last one may still be kept in the tree
+	const Int_t ib = TMath::BinarySearch((Long64_t)nBaskets+1, basketEntry, entry);
+	TBasket* basket = br->GetBasket(ib);
+
+	if (!basket || !basket->GetEntryOffset() || !basket->GetBufferRef()) {
+		fprintf(stderr, "Error reading basket %d of branch %s\n", ib, br->GetName());
+		exit(1);
+	}
+	basketFirst = basketEntry[ib];
+	basketEnd = ib < nBaskets ? basketEntry[ib+1] : br->GetEntries();
+
+	return basket;
+}
+
+ConvergenceMonitor::ConvergenceMonitor(int channel, const std::vector<int>& partIdx)
+{
+	char name[20];
+	// same binning as the energy and theta histograms, the proton theta has its own range
+	for (size_t i = 0; i < partIdx.size(); i++) {
+		snprintf(name, sizeof(name), "conv%d.e%d", channel, (int)i);
+		h.push_back(new TH1D(name, "", 1000, 0, 1000));
+		snprintf(name, sizeof(name), "conv%d.t%d", channel, (int)i);
+		if (partIdx[i] == 1)
+			h.push_back(new TH1D(name, "", 120, 0, 60));
+		else
+			h.push_back(new TH1D(name, "", 360, 0, 180));
+	}
+	for (std::vector<TH1D*>::iterator it = h.begin(); it != h.end(); ++it) {
+		(*it)->SetDirectory(0);
+		for (int j = 0; j < 2; j++) {
+			half[j].push_back((TH1D*)(*it)->Clone());
+			half[j].back()->SetDirectory(0);
+		}
+	}
+}
+
+ConvergenceMonitor::~ConvergenceMonitor()
+{
+	for (size_t i = 0; i < h.size(); i++) {
+		delete h[i];
+		delete half[0][i];
+		delete half[1][i];
+	}
+}
+
+void ConvergenceMonitor::fill(size_t particle, const TLorentzVector& v, int half)
+{
+	const double e = v.E()-v.M(), theta = v.Theta()*TMath::RadToDeg();
+	h[2*particle]->Fill(e);
+	h[2*particle+1]->Fill(theta);
+	this->half[half][2*particle]->Fill(e);
+	this->half[half][2*particle+1]->Fill(theta);
+}
+
+bool ConvergenceMonitor::check(Convergence criterion, double precision)
+{
+	bool converged = true;
+	double max, content;
+
+	for (size_t i = 0; i < h.size(); i++) {
+		if (criterion == CONV_RELERR) {
+			max = h[i]->GetBinContent(h[i]->GetMaximumBin());
+			for (int bin = 1; bin <= h[i]->GetNbinsX() && converged; bin++) {
+				content = h[i]->GetBinContent(bin);
+				if (content >= .01*max && 1./sqrt(content) > precision)
+					converged = false;
+			}
+		} else if (criterion == CONV_KS) {
+			/* The even and odd events form two independent samples of the same distribution, each with half of the events. Their maximum distance shrinks like 1.7/sqrt(N) with the total number of events N, so it drops below the precision once the shape is determined well enough, at about N = 3/precision^2. */
+			if (!half[0][i]->GetEntries() || !half[1][i]->GetEntries() || half[0][i]->KolmogorovTest(half[1][i], "M") > precision)
+				converged = false;
+		}
+	}
+
+	return converged;
+}
+
+void BatchQueue::push(EventBatch* b)
+{
+	std::unique_lock<std::mutex> lock(m);
+	notFull.wait(lock, [this] { return q.size() < depth; });
+	q.push_back(b);
+	notEmpty.notify_one();
+}
+
+EventBatch* BatchQueue::pop()
+{
+	std::unique_lock<std::mutex> lock(m);
+	notEmpty.wait(lock, [this] { return !q.empty() || closed; });
+	if (q.empty())
+		return 0;
+	EventBatch* b = q.front();
+	q.pop_front();
+	notFull.notify_one();
+	return b;
+}
+
+void BatchQueue::close()
+{
+	std::lock_guard<std::mutex> lock(m);
+	closed = true;
+	notEmpty.notify_all();
+}
+
+void P4Column::reserve(size_t size)
+{
+	if (mode == P4_FLOAT)
+		f.reserve(3*size);
+	else if (mode == P4_FIXED16)
+		s.reserve(3*size);
+	else
+		d.reserve(size);
+}
+
+Short_t P4Column::quantize(double x, bool& clipped) const
+{
+	double q = TMath::Nint(x/scale);
+	if (q > SHRT_MAX || q < -SHRT_MAX) {
+		clipped = true;
+		q = q > 0 ? SHRT_MAX : -SHRT_MAX;
+	}
+	return (Short_t)q;
+}
+
+bool P4Column::push_back(const TLorentzVector& v)
+{
+	bool clipped = false;
+	if (!n)  // all events contain the same on-shell particle
+		mass = v.M2() > 0 ? v.M() : 0;
+	n++;
+	if (mode == P4_FLOAT) {
+		f.push_back(v.X());
+		f.push_back(v.Y());
+		f.push_back(v.Z());
+	} else if (mode == P4_FIXED16) {
+		s.push_back(quantize(v.X(), clipped));
+		s.push_back(quantize(v.Y(), clipped));
+		s.push_back(quantize(v.Z(), clipped));
+	} else
+		d.push_back(v);
+
+	return !clipped;
+}
+
+TLorentzVector P4Column::operator[](size_t j) const
+{
+	double x, y, z;
+	if (mode == P4_FLOAT) {
+		x = f[3*j];
+		y = f[3*j+1];
+		z = f[3*j+2];
+	} else if (mode == P4_FIXED16) {
+		x = scale*s[3*j];
+		y = scale*s[3*j+1];
+		z = scale*s[3*j+2];
+	} else
+		return d[j];
+
+	return TLorentzVector(x, y, z, sqrt(x*x + y*y + z*z + mass*mass));
+}
+
+size_t P4Column::bytes_per_entry(P4Storage mode)
+{
+	if (mode == P4_FLOAT)
+		return 3*sizeof(Float_t);
+	else if (mode == P4_FIXED16)
+		return 3*sizeof(Short_t);
+	else
+		return sizeof(TLorentzVector);
+}
+
+void P4Column::clear(bool release)
+{
+	n = 0;
+	if (release) {
+		std::vector<TLorentzVector>().swap(d);
+		std::vector<Float_t>().swap(f);
+		std::vector<Short_t>().swap(s);
+	} else {
+		d.clear();
+		f.clear();
+		s.clear();
+	}
+}
+
+void P4Column::write(FILE* file) const
+{
+	Double_t x[4];
+	if (mode == P4_FLOAT)
+		fwrite(f.data(), sizeof(Float_t), f.size(), file);
+	else if (mode == P4_FIXED16)
+		fwrite(s.data(), sizeof(Short_t), s.size(), file);
+	else
+		for (size_t j = 0; j < n; j++) {
+			x[0] = d[j].X();
+			x[1] = d[j].Y();
+			x[2] = d[j].Z();
+			x[3] = d[j].T();
+			fwrite(x, sizeof(Double_t), 4, file);
+		}
+}
+
+bool P4Column::read(FILE* file, size_t size)
+{
+	Double_t x[4];
+	clear();
+	n = size;
+	if (mode == P4_FLOAT) {
+		f.resize(3*size);
+		return fread(f.data(), sizeof(Float_t), 3*size, file) == 3*size;
+	} else if (mode == P4_FIXED16) {
+		s.resize(3*size);
+		return fread(s.data(), sizeof(Short_t), 3*size, file) == 3*size;
+	}
+	d.reserve(size);
+	for (size_t j = 0; j < size; j++) {
+		if (fread(x, sizeof(Double_t), 4, file) != 4)
+			return false;
+		d.push_back(TLorentzVector(x[0], x[1], x[2], x[3]));
+	}
+	return true;
+}
+
+void PrecisionCheck::compare(const TLorentzVector& orig, const TLorentzVector& stored, const TAxis& axE, const TAxis& axTheta)
+{
+	// same quantities as filled in the energies and thetas histograms
+	int dE = abs(axE.FindFixBin(orig.E()-orig.M()) - axE.FindFixBin(stored.E()-stored.M()));
+	int dTheta = abs(axTheta.FindFixBin(orig.Theta()*TMath::RadToDeg()) - axTheta.FindFixBin(stored.Theta()*TMath::RadToDeg()));
+	if (dE > maxE)
+		maxE = dE;
+	if (dTheta > maxTheta)
+		maxTheta = dTheta;
+	if (dE || dTheta)
+		migrated++;
+	total++;
+}
+
 void prepare_hist(TH1 *h, const char* x_name, const char* y_name, Int_t color)
 {
 	h->GetXaxis()->SetLabelFont(42);
@@ -613,14 +1367,14 @@ void prepare_hist(THStack *h, const char* x_name, const char* y_name)
 TList* energies(const VVP4& p4, const std::vector<int> partIdx)
 {
 	const int nParticles = partIdx.size();
-	char name[5];
+	char name[20];
 	count++;
 
 	TList *l = new TList();
 
 	TH1F* h[nParticles+2];  // number of particles plus two additional energy sum histograms
 	for (int i = 0; i < nParticles; i++) {
-		sprintf(name, "h%d.%d", count-1, i);
+		snprintf(name, sizeof(name), "h%d.%d", count-1, i);
 		h[i] = new TH1F(name, "", 1000, 0, 1000);
 		prepare_hist(h[i], "E [MeV]", "#Events");
 		if (partIdx[i] == 1) {  // mark histogram with proton energy for later usage and set x-axis title to E_p
@@ -628,33 +1382,36 @@ TList* energies(const VVP4& p4, const std::vector<int> partIdx)
 			prepare_hist(h[i], "E_{p} [MeV]", "#Events");
 		}
 	}
-	sprintf(name, "hes%d", count-1);
+	snprintf(name, sizeof(name), "hes%d", count-1);
 	h[nParticles] = new TH1F(name, "Energy Sum", 950, 650, 1600);
 	prepare_hist(h[nParticles], "E_{sum} FS [MeV]", "#Events");
-	sprintf(name, "hec%d", count-1);
+	snprintf(name, sizeof(name), "hec%d", count-1);
 	h[nParticles+1] = new TH1F(name, "ESum thetaConstr", 1600, 0, 1600);
 	prepare_hist(h[nParticles+1], "E_{sum} CB [MeV]", "#Events");
 	// at last two histograms that count the number of particles in the CB and TAPS range
-	sprintf(name, "h2c%d", count-1);
+	snprintf(name, sizeof(name), "h2c%d", count-1);
 	TH2F *h2 = new TH2F(name, "ESum_nPart_CB", 400, 0, 1600, partIdx.size(), 0, partIdx.size());
 	prepare_hist(h2, "E_{sum} CB [MeV]", "#particles CB");
-	sprintf(name, "h2t%d", count);
+	snprintf(name, sizeof(name), "h2t%d", count);
 	TH2F *h3 = new TH2F(name, "ESum_nPart_TAPS", 400, 0, 1600, partIdx.size(), 0, partIdx.size());
 	prepare_hist(h3, "E_{sum} TAPS [MeV]", "#particles TAPS");
 
-	double esum, esum_constrCB, esum_constrTAPS, e;
+	double esum, esum_constrCB, esum_constrTAPS, e, theta;
 	int c, t;  // counter for CB/TAPS particles
+	TLorentzVector v;
 	for (int j = 0; j < p4[0].size(); j++) {
 		esum = esum_constrCB = esum_constrTAPS = c = t = 0;
 		for (int i = 0; i < nParticles; i++) {
-			e = p4[i][j].E()-p4[i][j].M();  // indices of particles (which are passed to this method) are coupled to the four-momenta due to collection process, therefore the usage of a simple for-loop with accessing the momenta via i is possible
+			v = p4[i][j];  // 4-vector is decoded from the storage precision, therefore only access it once
+			e = v.E()-v.M();  // indices of particles (which are passed to this method) are coupled to the four-momenta due to collection process, therefore the usage of a simple for-loop with accessing the momenta via i is possible
+			theta = v.Theta()*TMath::RadToDeg();
 			h[i]->Fill(e);
 			if (partIdx[i] != 1) {  // exclude proton (has always id 1) from energy sum
 				esum += e;
-				if (p4[i][j].Theta()*TMath::RadToDeg() > 20. && p4[i][j].Theta()*TMath::RadToDeg() < 160.) {  // only particles in CB range
+				if (theta > 20. && theta < 160.) {  // only particles in CB range
 					esum_constrCB += e;
 					c++;
-				} else if (p4[i][j].Theta()*TMath::RadToDeg() <= 20.) {  // only particles in TAPS
+				} else if (theta <= 20.) {  // only particles in TAPS
 					esum_constrTAPS += e;
 					t++;
 				}
@@ -681,14 +1438,14 @@ TList* energies(const VVP4& p4, const std::vector<int> partIdx)
 TList* thetas(const VVP4& p4, const std::vector<int> partIdx)
 {
 	const int nParticles = partIdx.size();
-	char name[5];
+	char name[20];
 	count++;
 
 	TList *l = new TList();
 
 	TH1F* h[nParticles];
 	for (int i = 0; i < nParticles; i++) {
-		sprintf(name, "h%d.%d", count-1, i);
+		snprintf(name, sizeof(name), "h%d.%d", count-1, i);
 		if (partIdx[i] == 1) {  // other dimensions needed for proton theta; mark histogram for later usage
 			h[i] = new TH1F(name, "p", 120, 0, 60);
 			prepare_hist(h[i], "#vartheta_{p} [#circ]", "#Events");
@@ -711,21 +1468,24 @@ TList* thetas(const VVP4& p4, const std::vector<int> partIdx)
 TList* theta_vs_energy(const VVP4& p4, const std::vector<int> partIdx)
 {
 	const int nParticles = partIdx.size();
-	char name[5];
+	char name[20];
 	count++;
 
 	TList *l = new TList();
 
 	TH2F* h[nParticles];
 	for (int i = 0; i < nParticles; i++) {
-		sprintf(name, "h%d.%d", count-1, i);
+		snprintf(name, sizeof(name), "h%d.%d", count-1, i);
 		h[i] = new TH2F(name, "", 200, 0, 1000, 180, 0, 180);
 		prepare_hist(h[i], "E [MeV]", "#vartheta [#circ]");
 	}
 
+	TLorentzVector v;
 	for (int j = 0; j < p4[0].size(); j++)
-		for (int i = 0; i < nParticles; i++)
-			h[i]->Fill(p4[i][j].E()-p4[i][j].M(), p4[i][j].Theta()*TMath::RadToDeg());
+		for (int i = 0; i < nParticles; i++) {
+			v = p4[i][j];
+			h[i]->Fill(v.E()-v.M(), v.Theta()*TMath::RadToDeg());
+		}
 
 	for (int i = 0; i < nParticles; i++)
 		l->Add(h[i]);
@@ -733,6 +1493,196 @@ TList* theta_vs_energy(const VVP4& p4, const std::vector<int> partIdx)
 	return l;
 }
 
+TList* photon_pairs(const VVP4& p4, const std::vector<int> partIdx, const std::vector<const char*> partNames)
+{
+	char name[20];
+	count++;
+
+	TList *l = new TList();
+
+	// only the photons of the final state are considered
+	std::vector<int> g;
+	for (int i = 0; i < partNames.size(); i++)
+		if (!strncmp(partNames[i], "gamma", 5))
+			g.push_back(i);
+	const int nPhotons = g.size();
+	const int nPairs = nPhotons*(nPhotons-1)/2;
+	if (nPairs < 1)
+		return l;
+
+	snprintf(name, sizeof(name), "hpa%d", count-1);
+	TH1F *h_angle = new TH1F(name, "opening angles", 360, 0, 180);
+	prepare_hist(h_angle, "#alpha_{#gamma#gamma} [#circ]", "#Pairs");
+	snprintf(name, sizeof(name), "hpm%d", count-1);
+	TH1F *h_min = new TH1F(name, "minimum opening angle", 360, 0, 180);
+	prepare_hist(h_min, "#alpha_{#gamma#gamma}^{min} [#circ]", "#Events");
+	snprintf(name, sizeof(name), "hpi%d", count-1);
+	TH1F *h_mass = new TH1F(name, "pair masses", 1000, 0, 1000);
+	prepare_hist(h_mass, "m_{#gamma#gamma} [MeV]", "#Pairs");
+	snprintf(name, sizeof(name), "hpc%d", count-1);
+	TH1F *h_mult = new TH1F(name, "clusters", nPhotons+1, 0, nPhotons+1);
+	prepare_hist(h_mult, "#clusters", "#Events");
+
+	// all combinations of two photons
+	std::vector<int> pa, pb;
+	for (int a = 0; a < nPhotons; a++)
+		for (int b = a+1; b < nPhotons; b++) {
+			pa.push_back(a);
+			pb.push_back(b);
+		}
+
+	/* The events are processed in blocks of PAIR_BLOCK events. First the unit direction vectors and energies of the photons are stored per photon for all events of the block, then the cosine of the opening angle and the squared invariant mass (2 E1 E2 (1 - cos alpha) for massless particles) are calculated per pair over all events of the block. These inner loops work on contiguous arrays without branches, so the compiler can vectorize them. Afterwards the histograms are filled event by event. */
+	std::vector<double> ux(nPhotons*PAIR_BLOCK), uy(nPhotons*PAIR_BLOCK), uz(nPhotons*PAIR_BLOCK), e(nPhotons*PAIR_BLOCK);
+	std::vector<double> cosine(nPairs*PAIR_BLOCK), mass2(nPairs*PAIR_BLOCK);
+	std::vector<int> label(nPhotons);
+	TLorentzVector v;
+	double mom, angle, minAngle;
+	int nb, clusters, old;
+	const int nEvents = p4[0].size();
+	for (int start = 0; start < nEvents; start += PAIR_BLOCK) {
+		nb = std::min(PAIR_BLOCK, nEvents-start);
+		for (int a = 0; a < nPhotons; a++)
+			for (int j = 0; j < nb; j++) {
+				v = p4[g[a]][start+j];
+				mom = v.P() > 0 ? v.P() : 1.;
+				ux[a*PAIR_BLOCK+j] = v.X()/mom;
+				uy[a*PAIR_BLOCK+j] = v.Y()/mom;
+				uz[a*PAIR_BLOCK+j] = v.Z()/mom;
+				e[a*PAIR_BLOCK+j] = v.E();
+			}
+
+		for (int q = 0; q < nPairs; q++) {
+			const double *xa = &ux[pa[q]*PAIR_BLOCK], *ya = &uy[pa[q]*PAIR_BLOCK], *za = &uz[pa[q]*PAIR_BLOCK], *ea = &e[pa[q]*PAIR_BLOCK];
+			const double *xb = &ux[pb[q]*PAIR_BLOCK], *yb = &uy[pb[q]*PAIR_BLOCK], *zb = &uz[pb[q]*PAIR_BLOCK], *eb = &e[pb[q]*PAIR_BLOCK];
+			double *c = &cosine[q*PAIR_BLOCK], *m2 = &mass2[q*PAIR_BLOCK];
+			for (int j = 0; j < nb; j++) {
+				c[j] = xa[j]*xb[j] + ya[j]*yb[j] + za[j]*zb[j];
+				m2[j] = 2*ea[j]*eb[j]*(1-c[j]);
+			}
+		}
+
+		for (int j = 0; j < nb; j++) {
+			minAngle = 180.;
+			clusters = nPhotons;
+			for (int a = 0; a < nPhotons; a++)
+				label[a] = a;
+			for (int q = 0; q < nPairs; q++) {
+				angle = TMath::ACos(std::max(-1., std::min(1., cosine[q*PAIR_BLOCK+j])))*TMath::RadToDeg();
+				h_angle->Fill(angle);
+				h_mass->Fill(sqrt(std::max(0., mass2[q*PAIR_BLOCK+j])));
+				if (angle < minAngle)
+					minAngle = angle;
+				// photons closer than MERGE_ANGLE end up in the same cluster, merge the clusters of both photons
+				if (angle < MERGE_ANGLE && label[pa[q]] != label[pb[q]]) {
+					old = label[pb[q]];
+					for (int a = 0; a < nPhotons; a++)
+						if (label[a] == old)
+							label[a] = label[pa[q]];
+					clusters--;
+				}
+			}
+			h_min->Fill(minAngle);
+			h_mult->Fill(clusters);
+		}
+	}
+
+	l->Add(h_angle);
+	l->Add(h_min);
+	l->Add(h_mass);
+	l->Add(h_mult);
+
+	return l;
+}
+
+void flush_chunk(VVP4& cols, const std::vector<int>& partIdx, const std::vector<const char*>& partNames, ChannelPlan& plan, bool last)
+{
+	const Int_t n = cols[0].size();
+	if (n) {
+		if (plan.mode == MODE_SPILL) {
+			// every chunk starts with its number of events, followed by the 4-vectors of every final state particle
+			fwrite(&n, sizeof(n), 1, plan.spill);
+			for (VVP4Iter it = cols.begin(); it != cols.end(); ++it)
+				it->write(plan.spill);
+			if (ferror(plan.spill)) {
+				perror("Error writing spill file");
+				exit(1);
+			}
+		} else
+			for (int a = 0; a < N_ANALYSES; a++)
+				merge_lists(plan.results[a], run_analysis((Analysis)a, cols, partIdx, partNames));
+	}
+
+	for (VVP4::iterator it = cols.begin(); it != cols.end(); ++it)
+		it->clear(last);
+}
+
+TList* run_analysis(Analysis a, const VVP4& p4, const std::vector<int>& partIdx, const std::vector<const char*>& partNames)
+{
+	switch (a) {
+		case ANA_ENERGIES:
+			return energies(p4, partIdx);
+		case ANA_THETAS:
+			return thetas(p4, partIdx);
+		case ANA_THETA_VS_ENERGY:
+			return theta_vs_energy(p4, partIdx);
+		default:
+			return photon_pairs(p4, partIdx, partNames);
+	}
+}
+
+void merge_lists(TList*& sum, TList* part)
+{
+	if (!sum) {
+		sum = part;
+		return;
+	}
+
+	// both lists are created by the same analysis method, so they contain the same histograms in the same order
+	TIter is(sum), ip(part);
+	TH1 *h;
+	while ((h = (TH1*)is.Next()))
+		h->Add((TH1*)ip.Next());
+	part->Delete();
+	delete part;
+}
+
+TList* analyse(Analysis a, int chan, const IntP4Map& p4, const IntVecintMap& idx, const IntVecharMap& names, IntPlanMap& plan)
+{
+	ChannelPlan& cp = plan.find(chan)->second;
+	const VVP4& cols = p4.find(chan)->second;
+	const std::vector<int>& partIdx = idx.find(chan)->second;
+	const std::vector<const char*>& partNames = names.find(chan)->second;
+	TList *l = 0;
+
+	if (cp.mode == MODE_STREAM) {  // already filled while reading, the caller takes over the histograms
+		l = cp.results[a];
+		cp.results[a] = 0;
+	} else if (cp.mode == MODE_SPILL) {
+		FILE* f = fopen(cp.spillFile, "rb");
+		if (!f) {
+			fprintf(stderr, "Error opening spill file %s: %s\n", cp.spillFile, strerror(errno));
+			exit(1);
+		}
+		VVP4 chunk(cols);  // empty columns with the storage settings of this channel
+		Int_t n;
+		while (fread(&n, sizeof(n), 1, f) == 1) {
+			for (VVP4::iterator it = chunk.begin(); it != chunk.end(); ++it)
+				if (!it->read(f, n)) {
+					fprintf(stderr, "Error reading spill file %s\n", cp.spillFile);
+					exit(1);
+				}
+			merge_lists(l, run_analysis(a, chunk, partIdx, partNames));
+		}
+		fclose(f);
+	} else
+		l = run_analysis(a, cols, partIdx, partNames);
+
+	if (!l)  // no events at all, return the empty histograms
+		l = run_analysis(a, cols, partIdx, partNames);
+
+	return l;
+}
+
 TH1F* etapEnergy_etap_eeg(const char* file)
 {
 	TFile f(file, "READ");